@@ -1,139 +1,1256 @@
-#include "LibDisk.h"
-#include <string.h>
-
-// the disk in memory (static makes it private to the file)
-static Sector *disk;
-
-// used to see what happened w/ disk ops
-Disk_Error_t diskErrno;
-
-// used for statistics
-// static int lastSector = 0;
-// static int seekCount = 0;
-
-/*
- * Disk_Init
- *
- * Initializes the disk area (really just some memory for now).
- *
- * THIS FUNCTION MUST BE CALLED BEFORE ANY OTHER FUNCTION IN HERE CAN BE USED!
- *
- */
-int Disk_Init() {
-    // create the disk image and fill every sector with zeroes
-    disk = (Sector *) calloc(NUM_SECTORS, sizeof(Sector));
-    if (disk == NULL) {
-        diskErrno = E_MEM_OP;
-        return -1;
-    }
-    return 0;
-}
-
-/*
- * Disk_Save
- *
- * Makes sure the current disk image gets saved to memory - this
- * will overwrite an existing file with the same name so be careful
- */
-int Disk_Save(char *file) {
-    FILE *diskFile;
-
-    // error check
-    if (file == NULL) {
-        diskErrno = E_INVALID_PARAM;
-        return -1;
-    }
-
-    // open the diskFile
-    if ((diskFile = fopen(file, "w")) == NULL) {
-        diskErrno = E_OPENING_FILE;
-        return -1;
-    }
-
-    // actually write the disk image to a file
-    if ((fwrite(disk, sizeof(Sector), NUM_SECTORS, diskFile)) != NUM_SECTORS) {
-        fclose(diskFile);
-        diskErrno = E_WRITING_FILE;
-        return -1;
-    }
-
-    // clean up and return
-    fclose(diskFile);
-    return 0;
-}
-
-/*
- * Disk_Load
- *
- * Loads a current disk image from disk into memory - requires that
- * the disk be created first.
- */
-int Disk_Load(char *file) {
-    FILE *diskFile;
-
-    // error check
-    if (file == NULL) {
-        diskErrno = E_INVALID_PARAM;
-        return -1;
-    }
-
-    // open the diskFile
-    if ((diskFile = fopen(file, "r")) == NULL) {
-        diskErrno = E_OPENING_FILE;
-        return -1;
-    }
-
-    // actually read the disk image into memory
-    if ((fread(disk, sizeof(Sector), NUM_SECTORS, diskFile)) != NUM_SECTORS) {
-        fclose(diskFile);
-        diskErrno = E_READING_FILE;
-        return -1;
-    }
-
-    // clean up and return
-    fclose(diskFile);
-    return 0;
-}
-
-/*
- * Disk_Read
- *
- * Reads a single sector from "disk" and puts it into a buffer provided
- * by the user.
- */
-int Disk_Read(int sector, char *buffer) {
-    // quick error checks
-    if ((sector < 0) || (sector >= NUM_SECTORS) || (buffer == NULL)) {
-        diskErrno = E_INVALID_PARAM;
-        return -1;
-    }
-
-    // copy the memory for the user
-    if ((memcpy((void *) buffer, (void *) (disk + sector), sizeof(Sector))) == NULL) {
-        diskErrno = E_MEM_OP;
-        return -1;
-    }
-
-    return 0;
-}
-
-/*
- * Disk_Write
- *
- * Writes a single sector from memory to "disk".
- */
-int Disk_Write(int sector, char *buffer) {
-    // quick error checks
-    if ((sector < 0) || (sector >= NUM_SECTORS) || (buffer == NULL)) {
-        diskErrno = E_INVALID_PARAM;
-        return -1;
-    }
-
-    // copy the memory for the user
-    if ((memcpy((void *) (disk + sector), (void *) buffer, sizeof(Sector))) == NULL) {
-        diskErrno = E_MEM_OP;
-        return -1;
-    }
-    return 0;
-}
-
+#define _GNU_SOURCE // O_DIRECT
+#include "LibDisk.h"
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#define DISK_BYTES ((size_t) NUM_SECTORS * sizeof(Sector))
+
+// buffer alignment O_DIRECT transfers need on common devices
+#define DIRECT_ALIGN 4096
+
+// the disk in memory (static makes it private to the file)
+static Sector *disk;
+
+// backend in use, and the one the next Disk_Init switches to
+static Disk_Backend_t backend = DISK_MMAP;
+static Disk_Backend_t nextBackend = DISK_MMAP;
+
+// image file descriptor for the pass-through backends
+static int imageFd = -1;
+
+// aligned staging sector for O_DIRECT when the caller's buffer is not
+static char *bounce = NULL;
+
+// image file `disk` mirrors, saves to it only write what changed
+static char *imageFile = NULL;
+static int mapped = 0;
+
+// device and inode of `imageFile`, so another name for it is recognized
+static dev_t imageDev = 0;
+static ino_t imageIno = 0;
+
+// one bit per sector written since the image file was last in sync
+static unsigned char dirty[(NUM_SECTORS + 7) / 8];
+static int dirtyCount = 0;
+
+// sectors written out by the last Disk_Save
+static int lastSaveCount = 0;
+
+// asynchronous requests submitted and not reaped yet
+static int queueDepth = DISK_QUEUE_DEPTH;
+static int nextQueueDepth = DISK_QUEUE_DEPTH;
+static int inFlight = 0;
+
+// requests the synchronous fallback already finished, waiting to be reaped
+static Disk_Completion done[DISK_MAX_QUEUE_DEPTH];
+static int doneCount = 0;
+
+static void Disk_RingClose();
+static void Disk_MarkDirty(int sector, int count);
+static int Disk_PieceLength(Disk_IOVec *vec, int count);
+
+// used to see what happened w/ disk ops
+Disk_Error_t diskErrno;
+
+// used for statistics
+static int lastSector = 0;
+static Disk_Stats stats;
+
+// what accesses cost, free unless asked otherwise
+static Disk_Timing timing;
+
+// write requests still to be failed on purpose, see Disk_FailWrites
+static int failWrites = 0;
+
+const Disk_Timing DISK_TIMING_NONE = {0, 0, 0, 0, 0, 0};
+
+// 7200 rpm drive: ~8ms full stroke, 4.2ms half a revolution, ~100MB/s
+const Disk_Timing DISK_TIMING_HDD = {10, 500, 0.8, 4167, 5, 0};
+
+// flash: no head to move, a fixed access latency and ~500MB/s
+const Disk_Timing DISK_TIMING_SSD = {20, 0, 0, 0, 1, 0};
+
+/*
+ * Disk_Account
+ *
+ * Charges one request for `count` sectors from `sector` on to the
+ * statistics and the timing model.
+ */
+static void Disk_Account(Disk_Op_t op, int sector, int count) {
+    double cost = timing.perRequest + count * timing.transfer;
+
+    if (op == DISK_OP_WRITE) {
+        stats.writes++;
+        stats.sectorsWritten += count;
+    } else {
+        stats.reads++;
+        stats.sectorsRead += count;
+    }
+    if (sector != lastSector) {
+        int distance = sector > lastSector ? sector - lastSector : lastSector - sector;
+        stats.seeks++;
+        stats.seekDistance += distance;
+        cost += timing.seekFixed + distance * timing.seekPerSector + timing.rotation;
+    }
+    lastSector = sector + count;
+    stats.elapsed += cost;
+
+    if (timing.realTime && cost > 0) {
+        struct timespec wait;
+        wait.tv_sec = (time_t) (cost / 1000000);
+        wait.tv_nsec = (long) ((cost - wait.tv_sec * 1000000.0) * 1000);
+        nanosleep(&wait, NULL);
+    }
+}
+
+/*
+ * Disk_WriteFault
+ *
+ * True when this write request is one Disk_FailWrites asked to fail, in
+ * which case diskErrno is set as for a failed pwrite.
+ */
+static int Disk_WriteFault() {
+    if (failWrites == 0)
+        return 0;
+    failWrites--;
+    diskErrno = E_WRITING_FILE;
+    return 1;
+}
+
+// true when sectors go straight to the image file instead of `disk`
+static int Disk_PassThrough() {
+    return backend == DISK_FILE || backend == DISK_DIRECT;
+}
+
+/*
+ * Disk_Aligned
+ *
+ * Returns a buffer O_DIRECT can transfer a sector through: the caller's
+ * own buffer when it is suitably aligned, otherwise the bounce sector.
+ */
+static char *Disk_Aligned(char *buffer) {
+    if (backend != DISK_DIRECT || (uintptr_t) buffer % DIRECT_ALIGN == 0)
+        return buffer;
+    return bounce;
+}
+
+/*
+ * Disk_Attach
+ *
+ * Records `file` as the image `disk` is in sync with and forgets all
+ * dirty sectors. NULL detaches.
+ */
+static int Disk_Attach(char *file) {
+    char *copy = NULL;
+    struct stat st;
+
+    if (file != NULL && (file != imageFile) && (copy = strdup(file)) == NULL) {
+        diskErrno = E_MEM_OP;
+        return -1;
+    }
+    if (file != imageFile) {
+        free(imageFile);
+        imageFile = copy;
+    }
+    imageDev = 0;
+    imageIno = 0;
+    if (file != NULL && stat(file, &st) == 0) {
+        imageDev = st.st_dev;
+        imageIno = st.st_ino;
+    }
+    memset(dirty, 0, sizeof(dirty));
+    dirtyCount = 0;
+    return 0;
+}
+
+/*
+ * Disk_IsImage
+ *
+ * True when `file` names the attached image, spelled the same or not
+ * (a relative path, a symlink, a hard link).
+ */
+static int Disk_IsImage(char *file) {
+    struct stat st;
+
+    if (imageFile == NULL)
+        return 0;
+    if (strcmp(file, imageFile) == 0)
+        return 1;
+    return stat(file, &st) == 0 && imageIno != 0 && st.st_dev == imageDev && st.st_ino == imageIno;
+}
+
+static int Disk_IsDirty(int sector) {
+    return (dirty[sector / 8] >> (sector % 8)) & 1;
+}
+
+/*
+ * Disk_NextDirtyRun
+ *
+ * Finds the first run of adjacent dirty sectors at or after `from`.
+ * Returns the run length and stores its first sector in `start`, or
+ * returns 0 when nothing after `from` is dirty.
+ */
+static int Disk_NextDirtyRun(int from, int *start) {
+    int sector = from;
+
+    while (sector < NUM_SECTORS && !Disk_IsDirty(sector)) {
+        // skip clean bytes whole
+        if (sector % 8 == 0 && dirty[sector / 8] == 0)
+            sector += 8;
+        else
+            sector++;
+    }
+    if (sector >= NUM_SECTORS)
+        return 0;
+
+    *start = sector;
+    while (sector < NUM_SECTORS && Disk_IsDirty(sector))
+        sector++;
+    return sector - *start;
+}
+
+/*
+ * Disk_SaveDirty
+ *
+ * Writes back only the dirty sectors of the attached image, one msync or
+ * pwrite per run of adjacent sectors.
+ */
+static int Disk_SaveDirty() {
+    int fd = -1;
+    int start, count;
+    int sector = 0;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+
+    lastSaveCount = 0;
+    if (dirtyCount == 0)
+        return 0;
+
+    // the data is already in the file, it only has to reach the device
+    if (Disk_PassThrough()) {
+        if (fdatasync(imageFd) == -1) {
+            diskErrno = E_WRITING_FILE;
+            return -1;
+        }
+        lastSaveCount = dirtyCount;
+        memset(dirty, 0, sizeof(dirty));
+        dirtyCount = 0;
+        return 0;
+    }
+
+    if (!mapped && (fd = open(imageFile, O_WRONLY)) == -1) {
+        diskErrno = E_OPENING_FILE;
+        return -1;
+    }
+
+    while ((count = Disk_NextDirtyRun(sector, &start)) > 0) {
+        size_t from = (size_t) start * sizeof(Sector);
+        size_t len = (size_t) count * sizeof(Sector);
+        int failed;
+
+        if (mapped) {
+            // msync wants a page aligned start
+            size_t aligned = from / page * page;
+            failed = msync((char *) disk + aligned, len + (from - aligned), MS_SYNC) == -1;
+        } else {
+            failed = pwrite(fd, (char *) (disk + start), len, (off_t) from) != (ssize_t) len;
+        }
+        if (failed) {
+            if (fd != -1)
+                close(fd);
+            diskErrno = E_WRITING_FILE;
+            return -1;
+        }
+        lastSaveCount += count;
+        sector = start + count;
+    }
+
+    if (fd != -1)
+        close(fd);
+    memset(dirty, 0, sizeof(dirty));
+    dirtyCount = 0;
+    return 0;
+}
+
+/*
+ * Disk_Release
+ *
+ * Drops whatever image is currently attached, heap copy, mapping or
+ * open file.
+ */
+static void Disk_Release() {
+    Disk_RingClose();
+    if (imageFd != -1)
+        close(imageFd);
+    imageFd = -1;
+    if (disk != NULL) {
+        if (mapped)
+            munmap(disk, DISK_BYTES);
+        else
+            free(disk);
+    }
+    disk = NULL;
+    mapped = 0;
+    Disk_Attach(NULL);
+}
+
+/*
+ * Disk_Map
+ *
+ * Maps an existing image file shared, so writes to `disk` land in the
+ * page cache of the file and nothing is copied up front.
+ */
+static int Disk_Map(char *file) {
+    int fd;
+    struct stat st;
+
+    if ((fd = open(file, O_RDWR)) == -1) {
+        diskErrno = E_OPENING_FILE;
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < DISK_BYTES) {
+        close(fd);
+        diskErrno = E_READING_FILE;
+        return -1;
+    }
+
+    void *map = mmap(NULL, DISK_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps its own reference
+    if (map == MAP_FAILED) {
+        diskErrno = E_MAPPING_FILE;
+        return -1;
+    }
+
+    Disk_Release();
+    disk = (Sector *) map;
+    mapped = 1;
+    if (Disk_Attach(file) == -1) {
+        Disk_Release();
+        return -1;
+    }
+    // the file actually mapped, even if the name was replaced meanwhile
+    imageDev = st.st_dev;
+    imageIno = st.st_ino;
+    return 0;
+}
+
+/*
+ * Disk_Open
+ *
+ * Opens an existing image file for the pass-through backends. Nothing is
+ * read, sectors are fetched with pread on every Disk_Read. Falls back to
+ * buffered I/O when the file system refuses O_DIRECT.
+ */
+static int Disk_Open(char *file) {
+    int fd = -1;
+    struct stat st;
+
+    if (backend == DISK_DIRECT)
+        fd = open(file, O_RDWR | O_DIRECT);
+    if (fd == -1 && (backend == DISK_FILE || errno == EINVAL))
+        fd = open(file, O_RDWR);
+    if (fd == -1) {
+        diskErrno = E_OPENING_FILE;
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < DISK_BYTES) {
+        close(fd);
+        diskErrno = E_READING_FILE;
+        return -1;
+    }
+
+    Disk_Release();
+    imageFd = fd;
+    if (Disk_Attach(file) == -1) {
+        Disk_Release();
+        return -1;
+    }
+    imageDev = st.st_dev;
+    imageIno = st.st_ino;
+    return 0;
+}
+
+/*
+ * Disk_Copy
+ *
+ * Copies the pass-through image to another file a sector at a time, the
+ * way Disk_Save writes out the in memory image.
+ */
+static int Disk_Copy(char *file) {
+    FILE *diskFile;
+    Sector sector;
+    int i;
+
+    if ((diskFile = fopen(file, "w")) == NULL) {
+        diskErrno = E_OPENING_FILE;
+        return -1;
+    }
+    for (i = 0; i < NUM_SECTORS; i++) {
+        if (Disk_Read(i, sector.data) == -1 || fwrite(&sector, sizeof(Sector), 1, diskFile) != 1) {
+            fclose(diskFile);
+            diskErrno = E_WRITING_FILE;
+            return -1;
+        }
+    }
+    fclose(diskFile);
+    lastSaveCount = NUM_SECTORS;
+    return 0;
+}
+
+/*
+ * Disk_SetBackend
+ *
+ * Picks where sectors are kept. Takes effect on the next Disk_Init.
+ */
+int Disk_SetBackend(Disk_Backend_t b) {
+    if (b != DISK_MEMORY && b != DISK_MMAP && b != DISK_FILE && b != DISK_DIRECT) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    nextBackend = b;
+    return 0;
+}
+
+/*
+ * Disk_Init
+ *
+ * Initializes the disk area (really just some memory for now). The mmap
+ * and pass-through backends have nothing to allocate until an image is
+ * loaded or created.
+ *
+ * THIS FUNCTION MUST BE CALLED BEFORE ANY OTHER FUNCTION IN HERE CAN BE USED!
+ *
+ */
+int Disk_Init() {
+    Disk_Release();
+    backend = nextBackend;
+    queueDepth = nextQueueDepth;
+    doneCount = 0;
+    if (backend == DISK_DIRECT && bounce == NULL &&
+        posix_memalign((void **) &bounce, DIRECT_ALIGN, sizeof(Sector)) != 0) {
+        bounce = NULL;
+        diskErrno = E_MEM_OP;
+        return -1;
+    }
+    if (backend != DISK_MEMORY)
+        return 0;
+
+    // create the disk image and fill every sector with zeroes
+    disk = (Sector *) calloc(NUM_SECTORS, sizeof(Sector));
+    if (disk == NULL) {
+        diskErrno = E_MEM_OP;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Disk_Create
+ *
+ * Creates a zero filled image file and attaches the disk to it - this
+ * will overwrite an existing file with the same name so be careful
+ */
+int Disk_Create(char *file) {
+    int fd;
+
+    // error check
+    if (file == NULL) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    // a sparse file reads back as zeroes, so no need to write them
+    if ((fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+        diskErrno = E_OPENING_FILE;
+        return -1;
+    }
+    if (ftruncate(fd, DISK_BYTES) == -1) {
+        close(fd);
+        diskErrno = E_WRITING_FILE;
+        return -1;
+    }
+    close(fd);
+
+    if (backend == DISK_MMAP)
+        return Disk_Map(file);
+    if (Disk_PassThrough())
+        return Disk_Open(file);
+    memset(disk, 0, DISK_BYTES);
+    return Disk_Attach(file);
+}
+
+/*
+ * Disk_Save
+ *
+ * Makes sure the current disk image gets saved to memory - this
+ * will overwrite an existing file with the same name so be careful.
+ * Saving back to the file the image was loaded from or last saved to,
+ * under any name, only writes the sectors changed since then.
+ */
+int Disk_Save(char *file) {
+    FILE *diskFile;
+
+    // error check
+    if (file == NULL || (disk == NULL && imageFd == -1)) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    // another name for the mapped file must not be truncated under the mapping
+    if (Disk_IsImage(file))
+        return Disk_SaveDirty();
+
+    if (Disk_PassThrough())
+        return Disk_Copy(file);
+
+    // open the diskFile
+    if ((diskFile = fopen(file, "w")) == NULL) {
+        diskErrno = E_OPENING_FILE;
+        return -1;
+    }
+
+    // actually write the disk image to a file
+    if ((fwrite(disk, sizeof(Sector), NUM_SECTORS, diskFile)) != NUM_SECTORS) {
+        fclose(diskFile);
+        diskErrno = E_WRITING_FILE;
+        return -1;
+    }
+
+    // clean up and return
+    fclose(diskFile);
+    lastSaveCount = NUM_SECTORS;
+    if (mapped)
+        return 0; // still mirrors the mapped file, not this copy
+    return Disk_Attach(file);
+}
+
+/*
+ * Disk_LastSaveCount
+ *
+ * Number of sectors the last successful Disk_Save wrote to the file.
+ */
+int Disk_LastSaveCount() {
+    return lastSaveCount;
+}
+
+/*
+ * Disk_Load
+ *
+ * Loads a current disk image from disk into memory - requires that
+ * the disk be created first. The mmap backend only maps the file, pages
+ * are brought in as sectors are touched.
+ */
+int Disk_Load(char *file) {
+    FILE *diskFile;
+
+    // error check
+    if (file == NULL) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    if (backend == DISK_MMAP)
+        return Disk_Map(file);
+    if (Disk_PassThrough())
+        return Disk_Open(file);
+
+    // open the diskFile
+    if ((diskFile = fopen(file, "r")) == NULL) {
+        diskErrno = E_OPENING_FILE;
+        return -1;
+    }
+
+    // actually read the disk image into memory
+    if ((fread(disk, sizeof(Sector), NUM_SECTORS, diskFile)) != NUM_SECTORS) {
+        fclose(diskFile);
+        diskErrno = E_READING_FILE;
+        return -1;
+    }
+
+    // clean up and return
+    fclose(diskFile);
+    return Disk_Attach(file);
+}
+
+/*
+ * Disk_Read
+ *
+ * Reads a single sector from "disk" and puts it into a buffer provided
+ * by the user.
+ */
+int Disk_Read(int sector, char *buffer) {
+    // quick error checks
+    if ((sector < 0) || (sector >= NUM_SECTORS) || (buffer == NULL) || (disk == NULL && imageFd == -1)) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    Disk_Account(DISK_OP_READ, sector, 1);
+    if (Disk_PassThrough()) {
+        char *target = Disk_Aligned(buffer);
+        if (pread(imageFd, target, sizeof(Sector), (off_t) sector * sizeof(Sector)) != sizeof(Sector)) {
+            diskErrno = E_READING_FILE;
+            return -1;
+        }
+        if (target != buffer)
+            memcpy(buffer, target, sizeof(Sector));
+        return 0;
+    }
+
+    // copy the memory for the user
+    if ((memcpy((void *) buffer, (void *) (disk + sector), sizeof(Sector))) == NULL) {
+        diskErrno = E_MEM_OP;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Disk_Write
+ *
+ * Writes a single sector from memory to "disk".
+ */
+int Disk_Write(int sector, char *buffer) {
+    // quick error checks
+    if ((sector < 0) || (sector >= NUM_SECTORS) || (buffer == NULL) || (disk == NULL && imageFd == -1)) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    if (Disk_WriteFault())
+        return -1;
+
+    Disk_Account(DISK_OP_WRITE, sector, 1);
+    if (Disk_PassThrough()) {
+        char *source = Disk_Aligned(buffer);
+        if (source != buffer)
+            memcpy(source, buffer, sizeof(Sector));
+        if (pwrite(imageFd, source, sizeof(Sector), (off_t) sector * sizeof(Sector)) != sizeof(Sector)) {
+            diskErrno = E_WRITING_FILE;
+            return -1;
+        }
+    } else if ((memcpy((void *) (disk + sector), (void *) buffer, sizeof(Sector))) == NULL) {
+        // copy the memory for the user
+        diskErrno = E_MEM_OP;
+        return -1;
+    }
+
+    Disk_MarkDirty(sector, 1);
+    return 0;
+}
+
+/*
+ * Disk_MarkDirty
+ *
+ * Remembers that `count` sectors from `sector` on need saving.
+ */
+static void Disk_MarkDirty(int sector, int count) {
+    int i;
+    for (i = sector; i < sector + count; i++) {
+        if (!Disk_IsDirty(i)) {
+            dirty[i / 8] |= 1 << (i % 8);
+            dirtyCount++;
+        }
+    }
+}
+
+#ifdef HAVE_IO_URING
+
+// submission and completion rings shared with the kernel
+static struct {
+    int fd;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize, sqesSize;
+    unsigned toSubmit;
+} ring = {.fd = -1};
+
+// what each in flight request was, indexed by the sqe user_data
+static struct {
+    long tag;
+    unsigned bytes;
+    int write;
+} slots[DISK_MAX_QUEUE_DEPTH];
+static int freeSlots[DISK_MAX_QUEUE_DEPTH];
+static int freeSlotCount = 0;
+
+/*
+ * Disk_RingOpen
+ *
+ * Sets up an io_uring with `queueDepth` entries for the image file.
+ * Returns -1 when the kernel does not offer io_uring, in which case the
+ * asynchronous calls complete synchronously.
+ */
+static int Disk_RingOpen() {
+    struct io_uring_params p;
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    if ((ring.fd = (int) syscall(__NR_io_uring_setup, queueDepth, &p)) < 0) {
+        ring.fd = -1;
+        return -1;
+    }
+
+    ring.sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cqRingSize > ring.sqRingSize)
+            ring.sqRingSize = ring.cqRingSize;
+        ring.cqRingSize = ring.sqRingSize;
+    }
+    ring.sqRing = mmap(NULL, ring.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                       IORING_OFF_SQ_RING);
+    if (ring.sqRing == MAP_FAILED) {
+        close(ring.fd);
+        ring.fd = -1;
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring.cqRing = ring.sqRing;
+    else
+        ring.cqRing = mmap(NULL, ring.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                           IORING_OFF_CQ_RING);
+    ring.sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                     IORING_OFF_SQES);
+    if (ring.cqRing == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        if (ring.cqRing != MAP_FAILED && ring.cqRing != ring.sqRing)
+            munmap(ring.cqRing, ring.cqRingSize);
+        if (ring.sqes != MAP_FAILED)
+            munmap(ring.sqes, ring.sqesSize);
+        munmap(ring.sqRing, ring.sqRingSize);
+        close(ring.fd);
+        ring.fd = -1;
+        return -1;
+    }
+
+    ring.sqHead = (unsigned *) ((char *) ring.sqRing + p.sq_off.head);
+    ring.sqTail = (unsigned *) ((char *) ring.sqRing + p.sq_off.tail);
+    ring.sqMask = (unsigned *) ((char *) ring.sqRing + p.sq_off.ring_mask);
+    ring.sqArray = (unsigned *) ((char *) ring.sqRing + p.sq_off.array);
+    ring.cqHead = (unsigned *) ((char *) ring.cqRing + p.cq_off.head);
+    ring.cqTail = (unsigned *) ((char *) ring.cqRing + p.cq_off.tail);
+    ring.cqMask = (unsigned *) ((char *) ring.cqRing + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) ((char *) ring.cqRing + p.cq_off.cqes);
+    ring.toSubmit = 0;
+
+    for (i = 0; i < queueDepth; i++)
+        freeSlots[i] = i;
+    freeSlotCount = queueDepth;
+    return 0;
+}
+
+/*
+ * Disk_RingEnter
+ *
+ * Hands queued submissions to the kernel and waits for at least
+ * `minComplete` completions.
+ */
+static int Disk_RingEnter(unsigned minComplete) {
+    unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int submitted;
+
+    if (ring.toSubmit == 0 && minComplete == 0)
+        return 0;
+    do {
+        submitted = (int) syscall(__NR_io_uring_enter, ring.fd, ring.toSubmit, minComplete, flags, NULL, 0);
+    } while (submitted < 0 && errno == EINTR);
+    if (submitted < 0) {
+        diskErrno = E_MEM_OP;
+        return -1;
+    }
+    ring.toSubmit -= (unsigned) submitted;
+    return 0;
+}
+
+/*
+ * Disk_RingReap
+ *
+ * Moves up to `max` finished requests from the completion ring into
+ * `completions`.
+ */
+static int Disk_RingReap(Disk_Completion *completions, int max) {
+    unsigned head = *ring.cqHead;
+    unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+    int count = 0;
+
+    while (head != tail && count < max) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+        int slot = (int) cqe->user_data;
+
+        completions[count].tag = slots[slot].tag;
+        completions[count].result = 0;
+        if (cqe->res != (int) slots[slot].bytes) {
+            completions[count].result = -1;
+            completions[count].error = slots[slot].write ? E_WRITING_FILE : E_READING_FILE;
+        }
+        freeSlots[freeSlotCount++] = slot;
+        inFlight--;
+        count++;
+        head++;
+    }
+    __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+static void Disk_RingClose() {
+    Disk_Completion scratch[16];
+
+    if (ring.fd == -1)
+        return;
+    // the kernel may still be using the caller's buffers, let it finish
+    while (inFlight > 0 && Disk_RingEnter(1) == 0)
+        Disk_RingReap(scratch, 16);
+    munmap(ring.sqes, ring.sqesSize);
+    if (ring.cqRing != ring.sqRing)
+        munmap(ring.cqRing, ring.cqRingSize);
+    munmap(ring.sqRing, ring.sqRingSize);
+    close(ring.fd);
+    ring.fd = -1;
+    inFlight = 0;
+}
+
+/*
+ * Disk_RingSubmit
+ *
+ * Queues one read or write of `count` sectors. Returns 1 when the request
+ * went to the ring, 0 when the ring cannot take it and the caller should
+ * do it synchronously.
+ */
+static int Disk_RingSubmit(Disk_Op_t op, int sector, int count, char *buffer, long tag) {
+    if (!Disk_PassThrough() || imageFd == -1)
+        return 0;
+    // O_DIRECT needs aligned buffers and the bounce sector is not shareable
+    if (backend == DISK_DIRECT && (uintptr_t) buffer % DIRECT_ALIGN != 0)
+        return 0;
+    if (ring.fd == -1 && Disk_RingOpen() == -1)
+        return 0;
+
+    unsigned tail = *ring.sqTail;
+    unsigned index = tail & *ring.sqMask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    int slot = freeSlots[--freeSlotCount];
+
+    Disk_Account(op, sector, count);
+    slots[slot].tag = tag;
+    slots[slot].bytes = (unsigned) (count * sizeof(Sector));
+    slots[slot].write = op == DISK_OP_WRITE;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op == DISK_OP_WRITE ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = imageFd;
+    sqe->addr = (unsigned long) buffer;
+    sqe->len = slots[slot].bytes;
+    sqe->off = (unsigned long long) sector * sizeof(Sector);
+    sqe->user_data = (unsigned long long) slot;
+    ring.sqArray[index] = index;
+    __atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring.toSubmit++;
+    inFlight++;
+    return 1;
+}
+
+/*
+ * Disk_RingTransfer
+ *
+ * Runs the pieces of a vectored transfer through the ring, keeping up to
+ * the queue depth of them in flight, and waits for all of them. Only used
+ * while nobody else has requests outstanding, so every completion reaped
+ * here belongs to this transfer. Returns 1 when done (check `failed`), 0
+ * when the ring is not usable and the caller has to do the work.
+ */
+static int Disk_RingTransfer(Disk_IOVec *vec, int count, Disk_Op_t op, int *failed) {
+    Disk_Completion completions[16];
+    int i, next = 0;
+
+    if (!Disk_PassThrough() || inFlight + doneCount > 0)
+        return 0;
+    if (backend == DISK_DIRECT) {
+        for (i = 0; i < count; i++)
+            if ((uintptr_t) vec[i].buffer % DIRECT_ALIGN != 0)
+                return 0;
+    }
+    if (ring.fd == -1 && Disk_RingOpen() == -1)
+        return 0;
+
+    *failed = 0;
+    while (next < count || inFlight > 0) {
+        while (next < count && inFlight < queueDepth) {
+            int length = Disk_PieceLength(vec + next, count - next);
+            Disk_RingSubmit(op, vec[next].sector, length, vec[next].buffer, 0);
+            next += length;
+        }
+        if (Disk_RingEnter(1) == -1) {
+            // nothing sensible to wait on anymore, drop the ring with them
+            Disk_RingClose();
+            *failed = 1;
+            return 1;
+        }
+        int reaped = Disk_RingReap(completions, 16);
+        for (i = 0; i < reaped; i++) {
+            if (completions[i].result == -1) {
+                *failed = 1;
+                diskErrno = completions[i].error;
+            }
+        }
+    }
+    return 1;
+}
+
+#else
+
+static void Disk_RingClose() {
+}
+
+static int Disk_RingSubmit(Disk_Op_t op, int sector, int count, char *buffer, long tag) {
+    return 0;
+}
+
+static int Disk_RingTransfer(Disk_IOVec *vec, int count, Disk_Op_t op, int *failed) {
+    return 0;
+}
+
+#endif // HAVE_IO_URING
+
+/*
+ * Disk_SetQueueDepth
+ *
+ * How many asynchronous requests may be in flight at once. Takes effect
+ * on the next Disk_Init.
+ */
+int Disk_SetQueueDepth(int depth) {
+    if (depth < 1 || depth > DISK_MAX_QUEUE_DEPTH) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    nextQueueDepth = depth;
+    return 0;
+}
+
+/*
+ * Disk_Submit
+ *
+ * Starts reading or writing `count` consecutive sectors from `sector` on.
+ * The buffer must stay untouched until Disk_Reap hands back a completion
+ * carrying `tag`. Fails with E_QUEUE_FULL once the queue depth is reached;
+ * reap something and retry.
+ */
+int Disk_Submit(Disk_Op_t op, int sector, int count, char *buffer, long tag) {
+    int i;
+
+    // quick error checks
+    if ((sector < 0) || (count < 1) || (sector + count > NUM_SECTORS) || (buffer == NULL) ||
+        (op != DISK_OP_READ && op != DISK_OP_WRITE)) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    if (inFlight + doneCount >= queueDepth) {
+        diskErrno = E_QUEUE_FULL;
+        return -1;
+    }
+
+    // a write asked to fail completes at once, also on backends that would queue it in the ring
+    if (op == DISK_OP_WRITE && Disk_WriteFault()) {
+        done[doneCount].tag = tag;
+        done[doneCount].result = -1;
+        done[doneCount].error = diskErrno;
+        doneCount++;
+        return 0;
+    }
+
+    if (op == DISK_OP_WRITE)
+        Disk_MarkDirty(sector, count);
+    if (Disk_RingSubmit(op, sector, count, buffer, tag))
+        return 0;
+
+    // no ring for this backend, finish it now and report it on the next reap
+    done[doneCount].tag = tag;
+    done[doneCount].result = 0;
+    for (i = 0; i < count; i++) {
+        char *sectorBuffer = buffer + (size_t) i * sizeof(Sector);
+        int result = op == DISK_OP_WRITE ? Disk_Write(sector + i, sectorBuffer) : Disk_Read(sector + i, sectorBuffer);
+        if (result == -1) {
+            done[doneCount].result = -1;
+            done[doneCount].error = diskErrno;
+            break;
+        }
+    }
+    doneCount++;
+    return 0;
+}
+
+/*
+ * Disk_Reap
+ *
+ * Collects up to `max` finished requests into `completions`, waiting until
+ * at least `wait` of them (capped at what is outstanding) are done.
+ * Returns how many were collected.
+ */
+int Disk_Reap(Disk_Completion *completions, int max, int wait) {
+    int count = 0;
+
+    if (completions == NULL || max < 1) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    while (doneCount > 0 && count < max) {
+        completions[count++] = done[--doneCount];
+        wait--;
+    }
+
+#ifdef HAVE_IO_URING
+    if (ring.fd != -1) {
+        if (wait > inFlight)
+            wait = inFlight;
+        if (wait > max - count)
+            wait = max - count;
+        if (Disk_RingEnter(wait > 0 ? (unsigned) wait : 0) == -1)
+            return -1;
+        count += Disk_RingReap(completions + count, max - count);
+    }
+#endif
+    return count;
+}
+
+/*
+ * Disk_Pending
+ *
+ * Requests submitted and not reaped yet.
+ */
+int Disk_Pending() {
+    return inFlight + doneCount;
+}
+
+/*
+ * Disk_PieceLength
+ *
+ * How many entries from the start of `vec` cover consecutive sectors with
+ * consecutive buffers, i.e. can move with a single memcpy or pread/pwrite.
+ */
+static int Disk_PieceLength(Disk_IOVec *vec, int count) {
+    int length = 1;
+    while (length < count && vec[length].sector == vec[0].sector + length &&
+           vec[length].buffer == vec[0].buffer + (size_t) length * sizeof(Sector))
+        length++;
+    return length;
+}
+
+/*
+ * Disk_TransferRun
+ *
+ * Moves `count` consecutive sectors between the disk and one contiguous
+ * buffer. Parameters are already checked.
+ */
+static int Disk_TransferRun(Disk_Op_t op, int sector, int count, char *buffer) {
+    size_t bytes = (size_t) count * sizeof(Sector);
+    off_t offset = (off_t) sector * sizeof(Sector);
+    int i;
+
+    if (!Disk_PassThrough()) {
+        Disk_Account(op, sector, count);
+        if (op == DISK_OP_WRITE) {
+            memcpy(disk + sector, buffer, bytes);
+            Disk_MarkDirty(sector, count);
+        } else {
+            memcpy(buffer, disk + sector, bytes);
+        }
+        return 0;
+    }
+
+    // O_DIRECT cannot take the buffer as is, go through the bounce sector
+    if (Disk_Aligned(buffer) != buffer) {
+        for (i = 0; i < count; i++) {
+            char *sectorBuffer = buffer + (size_t) i * sizeof(Sector);
+            if ((op == DISK_OP_WRITE ? Disk_Write(sector + i, sectorBuffer) : Disk_Read(sector + i, sectorBuffer)) == -1)
+                return -1;
+        }
+        return 0;
+    }
+
+    Disk_Account(op, sector, count);
+    while (bytes > 0) {
+        ssize_t moved = op == DISK_OP_WRITE ? pwrite(imageFd, buffer, bytes, offset) : pread(imageFd, buffer, bytes, offset);
+        if (moved <= 0) {
+            diskErrno = op == DISK_OP_WRITE ? E_WRITING_FILE : E_READING_FILE;
+            return -1;
+        }
+        buffer += moved;
+        offset += moved;
+        bytes -= (size_t) moved;
+    }
+    if (op == DISK_OP_WRITE)
+        Disk_MarkDirty(sector, count);
+    return 0;
+}
+
+/*
+ * Disk_TransferV
+ *
+ * Shared body of Disk_ReadV and Disk_WriteV: checks every entry up front,
+ * then moves each run of consecutive sectors and buffers in one go.
+ */
+static int Disk_TransferV(Disk_IOVec *vec, int count, Disk_Op_t op) {
+    int i, failed;
+
+    // quick error checks, once for the whole vector
+    if (vec == NULL || count < 0 || (disk == NULL && imageFd == -1)) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if ((vec[i].sector < 0) || (vec[i].sector >= NUM_SECTORS) || (vec[i].buffer == NULL)) {
+            diskErrno = E_INVALID_PARAM;
+            return -1;
+        }
+    }
+    if (count == 0)
+        return 0;
+    if (op == DISK_OP_WRITE && Disk_WriteFault())
+        return -1;
+
+    // scattered pieces on a file image overlap best in the ring
+    if (Disk_PieceLength(vec, count) < count && Disk_RingTransfer(vec, count, op, &failed)) {
+        if (op == DISK_OP_WRITE) {
+            for (i = 0; i < count; i++)
+                Disk_MarkDirty(vec[i].sector, 1);
+        }
+        return failed ? -1 : 0;
+    }
+
+    for (i = 0; i < count;) {
+        int length = Disk_PieceLength(vec + i, count - i);
+        if (Disk_TransferRun(op, vec[i].sector, length, vec[i].buffer) == -1)
+            return -1;
+        i += length;
+    }
+    return 0;
+}
+
+/*
+ * Disk_ReadV
+ *
+ * Reads `count` sectors, each into its own buffer. Entries for consecutive
+ * sectors whose buffers are also consecutive are read together.
+ */
+int Disk_ReadV(Disk_IOVec *vec, int count) {
+    return Disk_TransferV(vec, count, DISK_OP_READ);
+}
+
+/*
+ * Disk_WriteV
+ *
+ * Writes `count` sectors, each from its own buffer. Entries for consecutive
+ * sectors whose buffers are also consecutive are written together.
+ */
+int Disk_WriteV(Disk_IOVec *vec, int count) {
+    return Disk_TransferV(vec, count, DISK_OP_WRITE);
+}
+
+/*
+ * Disk_ReadRange
+ *
+ * Reads `count` consecutive sectors starting at `sector` into one buffer.
+ */
+int Disk_ReadRange(int sector, int count, char *buffer) {
+    // quick error checks
+    if ((sector < 0) || (count < 0) || (sector + count > NUM_SECTORS) || (buffer == NULL) ||
+        (disk == NULL && imageFd == -1)) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    if (count == 0)
+        return 0;
+    return Disk_TransferRun(DISK_OP_READ, sector, count, buffer);
+}
+
+/*
+ * Disk_WriteRange
+ *
+ * Writes `count` consecutive sectors starting at `sector` from one buffer.
+ */
+int Disk_WriteRange(int sector, int count, char *buffer) {
+    // quick error checks
+    if ((sector < 0) || (count < 0) || (sector + count > NUM_SECTORS) || (buffer == NULL) ||
+        (disk == NULL && imageFd == -1)) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    if (count == 0)
+        return 0;
+    if (Disk_WriteFault())
+        return -1;
+    return Disk_TransferRun(DISK_OP_WRITE, sector, count, buffer);
+}
+
+/*
+ * Disk_SetTiming
+ *
+ * Switches the timing model, e.g. to DISK_TIMING_HDD. Statistics keep
+ * accumulating across the switch.
+ */
+int Disk_SetTiming(const Disk_Timing *model) {
+    if (model == NULL || model->perRequest < 0 || model->seekFixed < 0 || model->seekPerSector < 0 ||
+        model->rotation < 0 || model->transfer < 0) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    timing = *model;
+    return 0;
+}
+
+/*
+ * Disk_GetStats
+ *
+ * Copies the counters gathered since the last Disk_ResetStats.
+ */
+int Disk_GetStats(Disk_Stats *out) {
+    if (out == NULL) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    *out = stats;
+    return 0;
+}
+
+/*
+ * Disk_ResetStats
+ *
+ * Zeroes every counter and parks the head at sector 0.
+ */
+void Disk_ResetStats() {
+    memset(&stats, 0, sizeof(stats));
+    lastSector = 0;
+}
+
+/*
+ * Disk_FailWrites
+ *
+ * Makes the next `count` write requests fail with E_WRITING_FILE without
+ * touching the disk, so callers can test how they handle a failing
+ * device. Zero stops failing writes.
+ */
+int Disk_FailWrites(int count) {
+    if (count < 0) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    failWrites = count;
+    return 0;
+}
@@ -1,8 +1,9 @@
 //
 // Disk.h
 //
-// Emulates a very simple disk (no timing issues). Allows user to
-// read and write to the disk just as if it was dealing with sectors
+// Emulates a very simple disk. Allows user to read and write to the
+// disk just as if it was dealing with sectors, optionally charging each
+// access what a real device would take.
 //
 //
 
@@ -17,6 +18,10 @@
 #define SECTOR_SIZE  512
 #define NUM_SECTORS  10000 
 
+// asynchronous requests in flight, default and upper bound
+#define DISK_QUEUE_DEPTH      64
+#define DISK_MAX_QUEUE_DEPTH  256
+
 // disk errors
 typedef enum {
   E_MEM_OP,
@@ -24,18 +29,95 @@ typedef enum {
   E_OPENING_FILE,
   E_WRITING_FILE,
   E_READING_FILE,
+  E_MAPPING_FILE,
+  E_QUEUE_FULL,
 } Disk_Error_t;
 
+// where the sectors actually live
+typedef enum {
+  DISK_MEMORY,  // whole image copied into a heap array
+  DISK_MMAP,    // image file mapped MAP_SHARED, sectors paged in on demand
+  DISK_FILE,    // every sector pread/pwritten straight to the image file
+  DISK_DIRECT,  // like DISK_FILE but bypassing the page cache with O_DIRECT
+} Disk_Backend_t;
+
 typedef struct sector {
   char data[SECTOR_SIZE];
 } Sector;
 
+// one sector of a scatter/gather transfer
+typedef struct disk_iovec {
+  int sector;
+  char* buffer;
+} Disk_IOVec;
+
+// asynchronous request kinds
+typedef enum {
+  DISK_OP_READ,
+  DISK_OP_WRITE,
+} Disk_Op_t;
+
+// a finished asynchronous request, handed back by Disk_Reap
+typedef struct disk_completion {
+  long tag;           // as given to Disk_Submit
+  int result;         // 0 on success, -1 on failure
+  Disk_Error_t error; // what went wrong when result is -1
+} Disk_Completion;
+
+// timing model, every cost in microseconds
+typedef struct disk_timing {
+  double perRequest;     // command overhead paid by every request
+  double seekFixed;      // settle time of any non-sequential access
+  double seekPerSector;  // head travel per sector of seek distance
+  double rotation;       // average rotational delay after a seek
+  double transfer;       // media transfer time per sector
+  int realTime;          // actually sleep for the charged time
+} Disk_Timing;
+
+extern const Disk_Timing DISK_TIMING_NONE;
+extern const Disk_Timing DISK_TIMING_HDD;
+extern const Disk_Timing DISK_TIMING_SSD;
+
+// what the disk has been asked to do since the last reset
+typedef struct disk_stats {
+  long reads;           // read requests
+  long writes;          // write requests
+  long sectorsRead;
+  long sectorsWritten;
+  long seeks;           // requests not starting where the last one ended
+  long seekDistance;    // total sectors travelled by those seeks
+  double elapsed;       // simulated device time in microseconds
+} Disk_Stats;
+
 extern Disk_Error_t diskErrno; // used to see what happened w/ disk ops
 
+int Disk_SetBackend(Disk_Backend_t backend);
 int Disk_Init();
+int Disk_Create(char* file);
 int Disk_Save(char* file);
+int Disk_LastSaveCount();
 int Disk_Load(char* file);
 int Disk_Write(int sector, char* buffer);
 int Disk_Read(int sector, char* buffer);
 
+// multi-sector transfers, consecutive sectors move in one copy
+int Disk_ReadV(Disk_IOVec* vec, int count);
+int Disk_WriteV(Disk_IOVec* vec, int count);
+int Disk_ReadRange(int sector, int count, char* buffer);
+int Disk_WriteRange(int sector, int count, char* buffer);
+
+// timing model and statistics
+int Disk_SetTiming(const Disk_Timing* timing);
+int Disk_GetStats(Disk_Stats* stats);
+void Disk_ResetStats();
+
+// fault injection for tests
+int Disk_FailWrites(int count);
+
+// asynchronous I/O, io_uring backed for DISK_FILE and DISK_DIRECT
+int Disk_SetQueueDepth(int depth);
+int Disk_Submit(Disk_Op_t op, int sector, int count, char* buffer, long tag);
+int Disk_Reap(Disk_Completion* completions, int max, int wait);
+int Disk_Pending();
+
 #endif // __Disk_H__
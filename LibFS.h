@@ -30,18 +30,56 @@ typedef enum {
 
 
 
+// capacity and free space, as reported by FS_Stat
+typedef struct fs_stat {
+    int block_size;
+    int total_blocks;
+    int free_blocks;
+    int total_inodes;
+    int free_inodes;
+} FS_Stat_t;
+
+// buffer and dentry cache counters, as reported by FS_CacheStats
+typedef struct fs_cache_stats {
+    long hits;
+    long misses;
+    long writebacks;
+    long dentry_hits;
+    long dentry_negative_hits; // names known not to exist
+    long dentry_misses;
+    long readahead_blocks; // sectors brought in ahead of sequential reads
+    long readahead_hits; // of those, sectors a read then used
+} FS_CacheStats_t;
+
+// one user buffer of File_ReadV and File_WriteV
+typedef struct fs_iovec {
+    void *buffer;
+    int size;
+} FS_IOVec;
+
 // File system generic call
 int FS_Boot(char *path);
+int FS_BootBackend(char *path, int backend); // backend is a Disk_Backend_t
 int FS_Sync();
+int FS_Stat(FS_Stat_t *stat);
+int FS_CacheStats(FS_CacheStats_t *stats);
 
 // file ops
 int File_Create(char *file);
+int File_CreateBatch(char *dir, char **names, int count); // all files or none, returns `count` or -1
 int File_Open(char *file);
 int File_Read(int fd, void *buffer, int size);
 int File_Write(int fd, void *buffer, int size);
 int File_Seek(int fd, int offset);
+// positional versions of File_Read and File_Write, the descriptor position is neither used nor moved
+int File_PRead(int fd, void *buffer, int size, int offset);
+int File_PWrite(int fd, void *buffer, int size, int offset);
+// File_Read and File_Write over several buffers in one call, the file data is contiguous
+int File_ReadV(int fd, FS_IOVec *vec, int count);
+int File_WriteV(int fd, FS_IOVec *vec, int count);
 int File_Close(int fd);
 int File_Unlink(char *file);
+int File_Rename(char *from, char *to); // moves the directory entry only, `to` must not exist
 
 void test_all();
 
@@ -50,6 +88,19 @@ int Dir_Create(char *path);
 int Dir_Size(char *path);
 int Dir_Read(char *path, void *buffer, int size);
 int Dir_Unlink(char *path);
+int Dir_UnlinkRecursive(char *path); // returns how many files and directories were removed
+int Dir_Rename(char *from, char *to);
+
+// streaming directory listing, the handle keeps the position between calls
+int Dir_Open(char *path);
+int Dir_ReadNext(int dir, void *buffer, int size);
+int Dir_Close(int dir);
+
+// calls relative to a directory handle from Dir_Open, `name` is a single component
+int File_CreateAt(int dir, char *name);
+int File_OpenAt(int dir, char *name);
+int File_UnlinkAt(int dir, char *name);
+int Dir_CreateAt(int dir, char *name);
 
 #endif /* __LibFS_h__ */
 
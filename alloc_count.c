@@ -0,0 +1,40 @@
+/*
+ * Test only: counts the heap allocations made by the code of this binary so
+ * the tests can check the file system hot paths never allocate. The linker
+ * sends the calls here with --wrap (see CMakeLists.txt), the memory still
+ * comes from the C library. The file system library itself has no hook.
+ */
+#include <stddef.h>
+
+volatile long heap_allocations = 0; // volatile, the compiler assumes malloc leaves globals alone
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+void *__real_aligned_alloc(size_t alignment, size_t size);
+int __real_posix_memalign(void **pointer, size_t alignment, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    heap_allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    heap_allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size) {
+    heap_allocations++;
+    return __real_realloc(pointer, size);
+}
+
+void *__wrap_aligned_alloc(size_t alignment, size_t size) {
+    heap_allocations++;
+    return __real_aligned_alloc(alignment, size);
+}
+
+int __wrap_posix_memalign(void **pointer, size_t alignment, size_t size) {
+    heap_allocations++;
+    return __real_posix_memalign(pointer, alignment, size);
+}